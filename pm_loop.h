@@ -0,0 +1,446 @@
+/* Loopback PicoMEM backend (TEST 2) - emulates the PicoMEM command port and
+ * its RAM window, along with an EDF5 server that serves a RAM volume, so the
+ * whole client (process2f(), caches, transport) can be run and profiled
+ * without any PicoMEM nor server, typically under DOSBox.
+ *
+ * The volume is a single (root) directory of up to LOOP_FILES files of up to
+ * LOOP_FILESZ bytes each (256K in all), empty at startup. It lives in
+ * conventional memory allocated by pm_irq_detect(), never freed (this is a
+ * test build).
+ *
+ * Latency and loss can be injected:
+ *  PM_LOOP_LATENCY = amount of dummy I/O reads (about 1 us each on an ISA
+ *                    bus) spent on each query
+ *  PM_LOOP_LOSS    = if non-zero, one query out of PM_LOOP_LOSS gets no
+ *                    answer (the command "times out"), which exercises the
+ *                    retry logic of sendquery()
+ * Both may be overriden on the compiler's command line (-dPM_LOOP_LOSS=10) */
+
+#ifndef PM_LOOP_LATENCY
+#define PM_LOOP_LATENCY 0
+#endif
+#ifndef PM_LOOP_LOSS
+#define PM_LOOP_LOSS 0
+#endif
+
+#define LOOP_FRAMESZ 4096  /* size of the emulated RAM window */
+#define LOOP_WINOFF 16     /* offset of the window (PM_PCCR_Param) */
+#define LOOP_TBLOFF (LOOP_WINOFF + LOOP_FRAMESZ) /* offset of the file table */
+#define LOOP_SCROFF (LOOP_TBLOFF + LOOP_FILES * sizeof(struct loopfile)) /* EQ_COMPOUND scratch */
+#define LOOP_FILES 16
+#define LOOP_FILESZ 16384u
+#define LOOP_FILEPARA (LOOP_FILESZ / 16)
+#define LOOP_DATE ((44 << 9) | (1 << 5) | 1) /* 2024-01-01 */
+
+struct loopfile {
+  unsigned char fcb[11]; /* FCB-style name, fcb[0] == 0 means 'unused' */
+  unsigned char attr;
+  unsigned short time;
+  unsigned short date;
+  unsigned long size;
+};
+
+static struct loopfile far *loop_tbl;  /* LOOP_FILES entries */
+static unsigned short loop_dataseg;    /* file #n data at loop_dataseg + n * LOOP_FILEPARA */
+static unsigned short loop_framesz = 1090; /* agreed upon with EQ_FRAMESZ */
+static unsigned char loop_feat;        /* features agreed upon with EQ_FRAMESZ */
+static unsigned short loop_count;      /* queries processed (loss model) */
+
+/* allocates the RAM window and the volume, returns 0 on success */
+static int loop_init(void)
+{
+  unsigned short winseg = 0, dataseg = 0, i;
+  unsigned short winpara = (LOOP_SCROFF + LOOP_FRAMESZ + 15) / 16;
+  unsigned short datapara = LOOP_FILES * LOOP_FILEPARA;
+  _asm {
+    mov ah, 48h
+    mov bx, winpara
+    int 21h
+    jc fail
+    mov winseg, ax
+    mov ah, 48h
+    mov bx, datapara
+    int 21h
+    jc fail
+    mov dataseg, ax
+    fail:
+  }
+  if (dataseg == 0) {
+    /* the window block alone must not be left behind */
+    if (winseg != 0) {
+      _asm {
+        push es
+        mov ah, 49h
+        mov es, winseg
+        int 21h
+        pop es
+      }
+    }
+    return(-1);
+  }
+  loop_tbl = MK_FP(winseg, LOOP_TBLOFF);
+  for (i = 0; i < LOOP_FILES; i++) loop_tbl[i].fcb[0] = 0;
+  loop_dataseg = dataseg;
+  BIOS_Segment = winseg;
+  PM_PCCR_Param = LOOP_WINOFF;
+  return(0);
+}
+
+/* converts path ("\NAME.EXT", len bytes, no terminator) to an FCB-style name
+ * into fcb, '*' being expanded to '?'. returns 0 on success, -1 if the path
+ * does not designate something in the root directory (the only one there
+ * is) */
+static int loop_fcb(unsigned char far *path, unsigned short len, unsigned char *fcb)
+{
+  unsigned short i, j = 0, end = 8;
+  unsigned char c;
+  if ((len < 2) || (path[0] != '\\')) return(-1);
+  for (i = 0; i < 11; i++) fcb[i] = ' ';
+  for (i = 1; i < len; i++) {
+    c = path[i];
+    if (c == '\\') return(-1);
+    if (c == '.') {
+      if (end == 11) return(-1); /* a second dot */
+      j = 8;
+      end = 11;
+      continue;
+    }
+    if (c == '*') {
+      while (j < end) fcb[j++] = '?';
+      continue;
+    }
+    if (j >= end) continue; /* too long, truncated like DOS does */
+    if ((c >= 'a') && (c <= 'z')) c -= ('a' - 'A');
+    fcb[j++] = c;
+  }
+  return(0);
+}
+
+/* returns the index of the first used file at or after pos that matches
+ * tmpl and attr, or -1 */
+static int loop_search(unsigned char far *tmpl, unsigned char attr, unsigned short pos)
+{
+  unsigned short j;
+  for (; pos < LOOP_FILES; pos++) {
+    if (loop_tbl[pos].fcb[0] == 0) continue;
+    if ((loop_tbl[pos].attr & 0x16) & ~attr) continue; /* hidden, system, dir */
+    for (j = 0; j < 11; j++) {
+      if ((tmpl[j] != '?') && (tmpl[j] != loop_tbl[pos].fcb[j])) break;
+    }
+    if (j == 11) return(pos);
+  }
+  return(-1);
+}
+
+/* returns the index of the file whose name is exactly fcb, or -1 */
+static int loop_find(unsigned char *fcb)
+{
+  unsigned short i, j;
+  for (i = 0; i < LOOP_FILES; i++) {
+    if (loop_tbl[i].fcb[0] == 0) continue;
+    for (j = 0; j < 11; j++) if (loop_tbl[i].fcb[j] != fcb[j]) break;
+    if (j == 11) return(i);
+  }
+  return(-1);
+}
+
+/* copies l bytes (byte by byte, no need to be fast here) */
+static void loop_copy(unsigned char far *d, unsigned char far *s, unsigned short l)
+{
+  while (l-- != 0) *d++ = *s++;
+}
+
+/* writes a FINDFIRST-style record (Afffffffffffttddssss) of file n to r */
+static void loop_dirent(unsigned char far *r, unsigned short n)
+{
+  r[0] = loop_tbl[n].attr;
+  loop_copy(r + 1, loop_tbl[n].fcb, 11);
+  ((unsigned short far *)(r + 12))[0] = loop_tbl[n].time;
+  ((unsigned short far *)(r + 12))[1] = loop_tbl[n].date;
+  *((unsigned long far *)(r + 16)) = loop_tbl[n].size;
+}
+
+/* returns a pointer to byte offs of file n */
+static unsigned char far *loop_data(unsigned short n, unsigned long offs)
+{
+  return(MK_FP(loop_dataseg + n * LOOP_FILEPARA + (unsigned short)(offs >> 4), (unsigned short)offs & 15));
+}
+
+/* validates the 'starting sector' ss of an open file, returns its index or
+ * -1 */
+static int loop_ss(unsigned short ss)
+{
+  if ((ss == 0) || (ss > LOOP_FILES) || (loop_tbl[ss - 1].fcb[0] == 0)) return(-1);
+  return(ss - 1);
+}
+
+/* processes the EDF5 query op with its plen bytes of payload at q, writes the
+ * answer's payload to a (room bytes at most, it may overlap q) and its
+ * length to *alen. returns the AX value of the answer */
+static unsigned short loop_op(unsigned char op, unsigned char far *q, unsigned short plen, unsigned char far *a, unsigned short room, unsigned short *alen)
+{
+  unsigned short err = 0, i, l;
+  unsigned char fcb[11], attr;
+  unsigned long offs;
+  int n;
+
+  *alen = 0;
+  switch (op) {
+    case 0x80: /* EQ_FRAMESZ: SS[F] -> SSF, FEAT_OPENRD and FEAT_COMPOUND */
+      loop_framesz = ((unsigned short far *)q)[0];
+      if (loop_framesz > LOOP_FRAMESZ) loop_framesz = LOOP_FRAMESZ;
+      loop_feat = (plen > 2) ? (q[2] & 6) : 0;
+      ((unsigned short far *)a)[0] = loop_framesz;
+      a[2] = loop_feat;
+      *alen = 3;
+      break;
+    case 0x01: /* RMDIR */
+    case 0x03: /* MKDIR */
+      err = 5; /* no subdirectories on this volume */
+      break;
+    case 0x05: /* CHDIR */
+      if ((plen != 1) || (q[0] != '\\')) err = 3;
+      break;
+    case 0x06: /* CLSFIL */
+    case 0x07: /* CMMTFIL */
+    case 0x0A: /* LOCKFIL */
+    case 0x0B: /* UNLOCKFIL */
+      break;
+    case 0x0C: /* DISKSPACE */
+      /* 1 sector of 512 bytes per cluster */
+      l = 0;
+      for (i = 0; i < LOOP_FILES; i++) {
+        if (loop_tbl[i].fcb[0] != 0) l += (unsigned short)((loop_tbl[i].size + 511) >> 9);
+      }
+      err = 1; /* AX = sectors per cluster */
+      ((unsigned short far *)a)[0] = LOOP_FILES * (LOOP_FILESZ / 512);
+      ((unsigned short far *)a)[1] = 512;
+      ((unsigned short far *)a)[2] = LOOP_FILES * (LOOP_FILESZ / 512) - l;
+      *alen = 6;
+      break;
+    case 0x0E: /* SETATTR: Afff... */
+      if ((loop_fcb(q + 1, plen - 1, fcb) != 0) || ((n = loop_find(fcb)) < 0)) {
+        err = 2;
+        break;
+      }
+      loop_tbl[n].attr = q[0];
+      break;
+    case 0x0F: /* GETATTR: fff... -> ttddssssA */
+      if ((loop_fcb(q, plen, fcb) != 0) || ((n = loop_find(fcb)) < 0)) {
+        err = 2;
+        break;
+      }
+      ((unsigned short far *)a)[0] = loop_tbl[n].time;
+      ((unsigned short far *)a)[1] = loop_tbl[n].date;
+      ((unsigned long far *)a)[1] = loop_tbl[n].size;
+      a[8] = loop_tbl[n].attr;
+      *alen = 9;
+      break;
+    case 0x11: /* RENAME: LSSS...DDD... */
+      if ((loop_fcb(q + 1, q[0], fcb) != 0) || ((n = loop_find(fcb)) < 0)) {
+        err = 2;
+        break;
+      }
+      if ((loop_fcb(q + 1 + q[0], plen - 1 - q[0], fcb) != 0) || (loop_find(fcb) >= 0)) {
+        err = 5;
+        break;
+      }
+      loop_copy(loop_tbl[n].fcb, fcb, 11);
+      break;
+    case 0x13: /* DELETE: fff... (wildcards allowed) */
+      if (loop_fcb(q, plen, fcb) != 0) {
+        err = 3;
+        break;
+      }
+      err = 2;
+      for (n = loop_search(fcb, 0, 0); n >= 0; n = loop_search(fcb, 0, n + 1)) {
+        loop_tbl[n].fcb[0] = 0;
+        err = 0;
+      }
+      break;
+    case 0x16: /* OPEN:     SSCCMMfff... -> AfffffffffffttddssssCCRRo */
+    case 0x17: /* CREATE */
+    case 0x2E: /* SPOPNFIL */
+      if (loop_fcb(q + 6, plen - 6, fcb) != 0) {
+        err = 3;
+        break;
+      }
+      n = loop_find(fcb);
+      l = 1; /* RR = opened */
+      if ((n < 0) && (op == 0x16)) {
+        err = 2;
+        break;
+      }
+      if ((n >= 0) && (op == 0x17)) { /* CREATE of an existing file truncates it */
+        loop_tbl[n].size = 0;
+        l = 3;
+      }
+      if (n < 0) { /* CREATE, or SPOPNFIL of a file that does not exist */
+        for (n = 0; n < LOOP_FILES; n++) if (loop_tbl[n].fcb[0] == 0) break;
+        if (n == LOOP_FILES) {
+          err = 4; /* too many files */
+          break;
+        }
+        loop_copy(loop_tbl[n].fcb, fcb, 11);
+        loop_tbl[n].attr = q[0] | 0x20; /* archive */
+        loop_tbl[n].time = 0;
+        loop_tbl[n].date = LOOP_DATE;
+        loop_tbl[n].size = 0;
+        l = 2;
+      }
+      i = q[0]; /* the stack word, ie. the open mode (OPEN only) */
+      loop_dirent(a, n);
+      ((unsigned short far *)a)[10] = n + 1; /* 'starting sector' */
+      ((unsigned short far *)a)[11] = l;
+      a[24] = (op == 0x16) ? (unsigned char)i : 2;
+      *alen = 25;
+      /* FEAT_OPENRD: append as much of the file as the frame can hold */
+      if ((loop_feat & 2) && (room > 25)) {
+        l = room - 25;
+        if (loop_tbl[n].size < l) l = (unsigned short)loop_tbl[n].size;
+        loop_copy(a + 25, loop_data(n, 0), l);
+        *alen += l;
+      }
+      break;
+    case 0x08: /* READFIL:  OOOOSSLL -> DDD... */
+    case 0x88: /* EQ_BULKREAD: OOOOSSLLPPPP -> LL */
+      if ((n = loop_ss(((unsigned short far *)q)[2])) < 0) {
+        err = 6; /* invalid handle */
+        break;
+      }
+      offs = ((unsigned long far *)q)[0];
+      l = ((unsigned short far *)q)[3];
+      if (offs >= loop_tbl[n].size) {
+        l = 0;
+      } else if (loop_tbl[n].size - offs < l) {
+        l = (unsigned short)(loop_tbl[n].size - offs);
+      }
+      if (op == 0x08) {
+        if (l > room) l = room;
+        loop_copy(a, loop_data(n, offs), l);
+        *alen = l;
+      } else {
+        loop_copy(*((unsigned char far * far *)(q + 8)), loop_data(n, offs), l);
+        ((unsigned short far *)a)[0] = l;
+        *alen = 2;
+      }
+      break;
+    case 0x09: /* WRITEFIL: OOOOSSDDD... -> LL */
+    case 0x89: /* EQ_BULKWRITE: OOOOSSLLPPPP -> LL */
+      if ((n = loop_ss(((unsigned short far *)q)[2])) < 0) {
+        err = 6;
+        break;
+      }
+      if (plen < 6) {
+        err = 1;
+        break;
+      }
+      offs = ((unsigned long far *)q)[0];
+      l = (op == 0x09) ? plen - 6 : ((unsigned short far *)q)[3];
+      if (offs >= LOOP_FILESZ) {
+        l = 0;
+      } else if (LOOP_FILESZ - offs < l) {
+        l = (unsigned short)(LOOP_FILESZ - offs); /* the volume is full */
+      }
+      if (op == 0x09) {
+        loop_copy(loop_data(n, offs), q + 6, l);
+      } else {
+        loop_copy(loop_data(n, offs), *((unsigned char far * far *)(q + 8)), l);
+      }
+      if (offs + l > loop_tbl[n].size) loop_tbl[n].size = offs + l;
+      ((unsigned short far *)a)[0] = l;
+      *alen = 2;
+      break;
+    case 0x1B: /* FINDFIRST:  Affff... -> AfffffffffffttddssssCCpp */
+    case 0x9B: /* EQ_FINDFIRSTB -> CC + records of Afffffffffffttddsssspp */
+      if ((loop_fcb(q + 1, plen - 1, fcb) != 0) || (q[0] == 8)) { /* no volume label */
+        err = 2;
+        break;
+      }
+      loop_copy(q + 5, fcb, 11); /* make it look like a FINDNEXT query */
+      q[4] = q[0];
+      ((unsigned short far *)q)[1] = 0xffff; /* so the search starts at 0 */
+      /* no break */
+    case 0x1C: /* FINDNEXT:  CCppAfffffffffff -> same as FINDFIRST */
+    case 0x9C: /* EQ_FINDNEXTB */
+      n = loop_search(q + 5, q[4], ((unsigned short far *)q)[1] + 1);
+      if (n < 0) {
+        err = ((op == 0x1B) || (op == 0x9B)) ? 2 : 18;
+        break;
+      }
+      if ((op & 0x80) == 0) {
+        loop_dirent(a, n);
+        ((unsigned short far *)a)[10] = 0; /* root 'cluster' */
+        ((unsigned short far *)a)[11] = n;
+        *alen = 24;
+        break;
+      }
+      /* batch: as many records as fit in the frame (the records overwrite
+       * the query, so I keep the search arguments aside first) */
+      attr = q[4];
+      loop_copy(fcb, q + 5, 11);
+      ((unsigned short far *)a)[0] = 0;
+      *alen = 2;
+      for (; (n >= 0) && (*alen + 22 <= room); n = loop_search(fcb, attr, n + 1)) {
+        loop_dirent(a + *alen, n);
+        ((unsigned short far *)(a + *alen))[10] = n;
+        *alen += 22;
+      }
+      break;
+    case 0x21: /* SKFMEND: ooooSS -> oooo */
+      if ((n = loop_ss(((unsigned short far *)q)[2])) < 0) {
+        err = 6;
+        break;
+      }
+      ((unsigned long far *)a)[0] = loop_tbl[n].size + ((signed long far *)q)[0];
+      *alen = 4;
+      break;
+    default:
+      err = 1; /* invalid function */
+      break;
+  }
+  return(err);
+}
+
+/* processes the EDF5 query of len bytes in the RAM window, writes the
+ * answer over it and returns the answer's length (0 = no answer). the
+ * sub-queries of an EQ_COMPOUND query are copied aside first, since their
+ * answers overwrite them */
+static unsigned short loop_query(unsigned short len)
+{
+  unsigned char far *f = MK_FP(BIOS_Segment, PM_PCCR_Param);
+  unsigned char far *q = f + 60;  /* query payload */
+  unsigned char far *a = f + 60;  /* answer payload (over the query) */
+  unsigned char far *c;
+  unsigned short plen, alen = 0, err = 0, i, l, sublen;
+
+  loop_count++;
+#if PM_LOOP_LATENCY > 0
+  for (i = 0; i < PM_LOOP_LATENCY; i++) inp(0x61);
+#endif
+#if PM_LOOP_LOSS > 0
+  if ((loop_count % PM_LOOP_LOSS) == 0) return(0);
+#endif
+  if ((len < 60) || (len > LOOP_FRAMESZ)) return(0);
+  plen = len - 60;
+
+  if (f[59] == 0x81) { /* EQ_COMPOUND: (QDNNppp...)... -> (AXNNppp...)... */
+    c = MK_FP(BIOS_Segment, LOOP_SCROFF);
+    loop_copy(c, q, plen);
+    for (i = 0; i + 4 <= plen; i += 4 + l) {
+      l = ((unsigned short far *)(c + i))[1];
+      if ((i + 4 + l > plen) || (alen + 4 > loop_framesz - 60)) {
+        err = 1;
+        break;
+      }
+      ((unsigned short far *)(a + alen))[0] = loop_op(c[i], c + i + 4, l, a + alen + 4, loop_framesz - 60 - alen - 4, &sublen);
+      ((unsigned short far *)(a + alen))[1] = sublen;
+      alen += 4 + sublen;
+    }
+  } else {
+    err = loop_op(f[59], q, plen, a, loop_framesz - 60, &alen);
+  }
+  ((unsigned short far *)f)[29] = err; /* AX */
+  ((unsigned short far *)f)[26] = alen + 60;
+  return(alen + 60);
+}
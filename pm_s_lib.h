@@ -2,7 +2,9 @@
 // Basic PicoMEM library full include, to use with any C Code
 
 #define PM_ETHDFS 1
-#define TEST 1   // 1 for Test Mode (No PicoMEM)
+#ifndef TEST
+#define TEST 1   // 1 for Test Mode (No PicoMEM), 2 for the loopback backend (pm_loop.h)
+#endif
 
 // * Status and Commands definition
 #define STAT_READY         0x00  // Ready to receive a command
@@ -14,6 +16,16 @@
 
 #define DEFAULT_BASE 0x2A0
 
+// * Commands completion wait modes (PM_WaitMode)
+#define PM_WAIT_POLL       0     // Read the status port in a loop until the command ends
+#define PM_WAIT_HLT        1     // Halt the CPU between two status reads, until the PicoMEM IRQ
+                                 // raised at the end of the command (or the timer) wakes it up
+
+// * EtherDFS commands (Processed by the PicoMEM firmware)
+#define CMD_EDFS_QUERY     0x70  // Process the EDF5 frame present at BIOS_Segment:PM_PCCR_Param
+                                 // arg: query frame length, return: answer frame length (0 on error)
+                                 // The answer is written over the query, in the same RAM window
+
 #if (PM_ETHDFS==0)
 // For ETHDFS : Need to declare in the data segment
 unsigned short PM_Base=0;         // PicoMEM I/O Base address
@@ -22,21 +34,51 @@ unsigned char  PM_BoardID=0;      // PicoMEM Board model/ID
 unsigned short PM_FW_Rev=0;       // PicoMEM firmware Revision
 unsigned short BIOS_Segment=0;    // PicoMEM BIOS segment (Can be 0 if not detected)
 unsigned short PM_PCCR_Param=0;   // Commands parameter RAM address (To send/Receive small data to/from command)
+unsigned char  PM_WaitMode=PM_WAIT_POLL; // How pm_wait_cmd_end() waits for the command end
+#endif
+
+#if (TEST==2)
+#include "pm_loop.h"  // Emulated PicoMEM and EDF5 server, on a RAM volume
 #endif
 
 
-bool pm_wait_cmd_end()
+// Wait for the end of the command in progress, for up to timeout BIOS ticks (0: no limit)
+// On timeout, the command is reset and false is returned
+bool pm_wait_cmd_end(unsigned short timeout)
 {
 #if TEST
  return true;
 #else
+  unsigned short volatile far *rtc = (unsigned short far *)0x46C;
+  unsigned short start = *rtc;
+  uint8_t res;
   while(true)
   {
-    uint8_t res=inp(PM_Base);
+    if (PM_WaitMode==PM_WAIT_HLT)
+       { // Interrupts are off from the status read to the HLT, so that the IRQ can't
+         // come in between (STI takes effect after the next instruction only)
+        _asm cli
+        res=inp(PM_Base);
+        if (res==STAT_CMDINPROGRESS)
+           {
+            _asm {
+              sti
+              hlt
+            }
+           }
+           else _asm sti
+       }
+       else res=inp(PM_Base);
     switch (res)
         {
      case STAT_READY        : return true;
-     case STAT_CMDINPROGRESS: break;   // In progress, Loop
+     case STAT_CMDINPROGRESS: // In progress, Loop (unless too long)
+                              if ((timeout!=0) && ((unsigned short)(*rtc-start)>=timeout))
+                                 {
+                                  outp(PM_Base,0);  // Give up : Reset the command
+                                  return false;
+                                 }
+                              break;
      case STAT_CMDERROR     :  // Status not used for the moment
      case STAT_CMDNOTFOUND  : //printf("CMD Error\n");
                               outp(PM_Base,0);  // Error : Reset and go check again the status
@@ -52,16 +94,20 @@ bool pm_wait_cmd_end()
 }
 
 // Send a command via I/O with argument and return a word
-unsigned short pm_io_cmd(unsigned char cmd,unsigned short arg)
+// (0 if the PicoMEM is not ready or the command did not end within timeout ticks)
+unsigned short pm_io_cmd(unsigned char cmd,unsigned short arg,unsigned short timeout)
 {
-#if TEST
+#if (TEST==2)
+ if (cmd==CMD_EDFS_QUERY) return loop_query(arg);
+ return 0;
+#elif TEST
  return 0;
 #else    
-  if (pm_wait_cmd_end())
+  if (pm_wait_cmd_end(timeout))
    {
     outpw(PM_Base+1,arg);   // Send the parameters
     outp(PM_Base,cmd);      // Send the command
-    pm_wait_cmd_end();
+    if (!pm_wait_cmd_end(timeout)) return 0;
     return inpw(PM_Base+1);
    }     
   return 0;
@@ -84,7 +130,10 @@ unsigned short pm_io_cmd(unsigned char cmd,unsigned short arg)
 */
 bool pm_irq_detect()
 {
-#if TEST    // Return fake PicoMEM Status
+#if (TEST==2) // Loopback backend: the "BIOS RAM" is allocated in conventional memory
+ PM_Base=0x220;
+ return (loop_init()==0);
+#elif TEST    // Return fake PicoMEM Status
  BIOS_Segment=0xD000;
  PM_Base=0x220;
  return true;
@@ -117,13 +166,14 @@ mov dx,0x1234
 mov cx,0xFFFF         //For BIOS fonction detect
 int 0x13
 // If CX is still 0xFFFF the BIOS Does not support this fonction.
-cmp cx,0FFFF
+cmp cx,0FFFFh
 je @no_bios_3
 mov PM_BoardID,al     // Collect the different infos
 mov PM_PicoID,ah
 mov PM_PCCR_Param,cx
 @no_bios_3:           // All the linked variables remains at 0
 mov al,1              // Return true
+jmp @@end
 @@no_bios:
 mov al,0              // Return false
 @@end: